@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdarg.h>
@@ -9,23 +10,46 @@
 
 #include <sys/wait.h>
 
-#define SV_IMPLEMENTATION
-#include "sv.h"
+#define MDPP_IMPLEMENTATION
+#include "mdpp.h"
 
 enum {
     PIPE_READ = 0,
     PIPE_WRITE
 };
 
+// markdown renders into is_pipe outputs
 typedef struct {
-    FILE *src;
-    FILE *dest;
-    FILE *shell_write;
-    FILE *shell_read;
-    bool dest_is_pipe;
-    bool in_code_block;
+    FILE *stream;
+    bool is_pipe;
+} Output;
+
+// Shell backend logging every interaction with inner to a trace (--record)
+typedef struct {
+    Mdpp_Shell inner;
+    FILE *trace;
+} Record_Shell;
+
+// Shell backend answering from a recorded trace (--replay)
+typedef struct {
+    const char *path;
+    Mdpp_Buffer trace;
+    String_View rest;
+} Replay_Shell;
 
-    bool header_is_open;
+typedef struct {
+    Mdpp *mdpp;
+    FILE *src;
+    const char *src_name;
+    Output outputs[MDPP_OUTPUTS_CAP];
+    size_t outputs_count;
+    // The /bin/sh backend, when it was started
+    Mdpp_Shell shell;
+    Record_Shell record;
+    Replay_Shell replay;
+    FILE *json;
+    FILE *profile;
+    bool stats;
 } Context;
 
 void
@@ -39,351 +63,307 @@ die(const char *fmt, ...)
 }
 
 bool
-next_line(String_View *sv, FILE *stream)
+write_file(void *user, const char *data, size_t count)
 {
-    errno = 0;
-    char *lineptr = NULL;
-    size_t n = 0;
-    int read = getline(&lineptr, &n, stream); 
-    if (errno != 0) {
-        die("ERROR: Unable to read next line: %s\n", strerror(errno));
-    }
-
-    if (read < 1) return false;
-
-    *sv = sv_trim_right(sv_from_parts(lineptr, read));
-    return true;
+    return fwrite(data, 1, count, (FILE*)user) == count;
 }
 
 void
-shell_exec(Context *ctx, String_View command, String_View *result)
+read_file(FILE *stream, const char *name, Mdpp_Buffer *buf)
 {
-    fprintf(ctx->shell_write, SV_Fmt ";\n", SV_Arg(command));
-    fflush(ctx->shell_write);
-    // TODO: Handle multi-line shell return?
-    if (result) {
-        next_line(result, ctx->shell_read);
-    } else {
-        fflush(ctx->shell_read);
+    char chunk[64*1024];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), stream)) > 0) {
+        if (!mdpp_buffer_write(buf, chunk, n)) {
+            die("ERROR: Unable to read `%s`: out of memory\n", name);
+        }
+    }
+    if (ferror(stream)) {
+        die("ERROR: Unable to read `%s`: %s\n", name, strerror(errno));
     }
 }
 
+// Traces are a sequence of frames, each a tag and length followed by the data:
+//   exec 7
+//   echo hi
+//   result 2
+//   hi
+// Commands have an exec frame followed by a result frame, variables have a set
+// frame (the name) followed by a value frame.
 void
-shell_set(Context *ctx, String_View name, String_View val)
+trace_write(FILE *trace, const char *tag, const char *data, size_t count)
 {
-    fprintf(ctx->shell_write, SV_Fmt "='" SV_Fmt "';\n", SV_Arg(name),
-            SV_Arg(val));
-    fflush(ctx->shell_write);
+    fprintf(trace, "%s %zu\n", tag, count);
+    fwrite(data, 1, count, trace);
+    fputc('\n', trace);
+    if (ferror(trace)) die("ERROR: Unable to write trace: %s\n", strerror(errno));
 }
 
-String_View
-execute(String_View command)
+bool
+record_shell_exec(void *user, Mdpp *mdpp, const char *command, size_t count,
+                  const char **result, size_t *result_count)
 {
-    char *cmd = calloc(command.count, sizeof(*cmd));
-    strncpy(cmd, command.data, command.count);
-    FILE *pp = popen(cmd, "r");
-    if (pp == NULL) {
-        // TODO: The popen() function does not set errno if memory allocation fails.
-        die("ERROR: Unable to open pipe to command " SV_Fmt ": %s\n",
-            SV_Arg(command), strerror(errno));
-    }
-
-    // TODO: Handle multi-line shell return?
-    String_View result;
-    next_line(&result, pp);
-    pclose(pp);
-    return result;
+    Record_Shell *rs = user;
+    if (!rs->inner.exec(rs->inner.user, mdpp, command, count, result,
+                        result_count)) {
+        return false;
+    }
+    trace_write(rs->trace, "exec", command, count);
+    trace_write(rs->trace, "result", *result, *result_count);
+    return true;
 }
 
 bool
-index_of_delim(String_View sv, String_View delim, size_t *index)
+record_shell_set(void *user, Mdpp *mdpp, const char *name, size_t name_count,
+                 const char *val, size_t val_count)
 {
-    // Could not find
-    size_t n = 0;
-    if (!sv_find(sv, delim, &n)) return false;
-
-    // Found an escaped occurence
-    if (n > 0 && *(sv.data + n - 1) == '\\') {
-        n += delim.count;
-        sv_chop_left(&sv, n);
-
-        size_t nindex = 0;
-        if (!index_of_delim(sv, delim, &nindex)) return false;
-
-        if (index) *index = n + nindex;
-        return true;
+    Record_Shell *rs = user;
+    if (!rs->inner.set(rs->inner.user, mdpp, name, name_count, val,
+                       val_count)) {
+        return false;
     }
-
-    if (index) *index = n;
+    trace_write(rs->trace, "set", name, name_count);
+    trace_write(rs->trace, "value", val, val_count);
     return true;
 }
 
-void
-preprocess_shell(Context *ctx, String_View sv)
+String_View
+trace_next(Replay_Shell *rs, String_View tag)
 {
-    String_View result;
-    shell_exec(ctx, sv, &result);
-    fprintf(ctx->dest, SV_Fmt, SV_Arg(result));
-}
+    if (rs->rest.count == 0) {
+        die("ERROR: Trace `%s` ended before " SV_Fmt " frame\n", rs->path,
+            SV_Arg(tag));
+    }
 
-void
-preprocess_tex(Context *ctx, String_View sv)
-{
-    fprintf(ctx->dest, "<djl-tex>" SV_Fmt "</djl-tex>", SV_Arg(sv));
+    String_View header = sv_chop_by_delim(&rs->rest, '\n');
+    String_View got = sv_chop_by_delim(&header, ' ');
+    if (!sv_eq(got, tag)) {
+        die("ERROR: Trace `%s` has " SV_Fmt " frame where " SV_Fmt
+            " was expected\n", rs->path, SV_Arg(got), SV_Arg(tag));
+    }
+
+    size_t n = sv_to_u64(header);
+    if (n >= rs->rest.count || rs->rest.data[n] != '\n') {
+        die("ERROR: Trace `%s` has a truncated " SV_Fmt " frame\n", rs->path,
+            SV_Arg(tag));
+    }
+    String_View data = sv_chop_left(&rs->rest, n);
+    sv_chop_left(&rs->rest, 1);
+    return data;
 }
 
-void
-preprocess_head(Context *ctx, String_View sv)
+bool
+replay_shell_exec(void *user, Mdpp *mdpp, const char *command, size_t count,
+                  const char **result, size_t *result_count)
 {
-    ctx->header_is_open = !ctx->header_is_open;
-    fprintf(ctx->dest, ctx->header_is_open ? "<head>" : "</head>");
-    (void)sv;
+    Replay_Shell *rs = user;
+    String_View expected = trace_next(rs, SV("exec"));
+    if (!sv_eq(expected, sv_from_parts(command, count))) {
+        die("ERROR: Trace `%s` expected command `" SV_Fmt "` but got `%.*s`\n",
+            rs->path, SV_Arg(expected), (int)count, command);
+    }
+
+    // The trace outlives the document, no need to copy
+    String_View response = trace_next(rs, SV("result"));
+    *result = response.data;
+    *result_count = response.count;
+    (void)mdpp;
+    return true;
 }
 
-void
-preprocess_title(Context *ctx, String_View sv)
+bool
+replay_shell_set(void *user, Mdpp *mdpp, const char *name, size_t name_count,
+                 const char *val, size_t val_count)
 {
-    fprintf(ctx->dest, "<title>" SV_Fmt "</title>", SV_Arg(sv));
-    // Set $title in shell
-    shell_set(ctx, SV("title"), sv);
+    Replay_Shell *rs = user;
+    String_View expected = trace_next(rs, SV("set"));
+    String_View expected_val = trace_next(rs, SV("value"));
+    if (!sv_eq(expected, sv_from_parts(name, name_count))
+            || !sv_eq(expected_val, sv_from_parts(val, val_count))) {
+        die("ERROR: Trace `%s` expected `" SV_Fmt "=" SV_Fmt "` but got"
+            " `%.*s=%.*s`\n", rs->path, SV_Arg(expected),
+            SV_Arg(expected_val), (int)name_count, name, (int)val_count, val);
+    }
+    (void)mdpp;
+    return true;
 }
 
 void
-preprocess_meta(Context *ctx, String_View sv)
+usage(const char *progname)
 {
-    // TODO: Support spaces
-    size_t n;
-    sv_index_of(sv, ' ', &n);
-    if (!n) die("ERROR: %meta directive requires two arguments\n");
-    String_View name = sv_chop_left(&sv, n);
-    String_View val = sv_trim(sv);
-
-    fprintf(ctx->dest, "<meta name=\"" SV_Fmt "\" content=\"" SV_Fmt "\">",
-            SV_Arg(name), SV_Arg(val));
-    shell_set(ctx, name, val);
+    die("USAGE: %s [-e] [-j JOBS] [--chunk-min BYTES] [--md FILE] [--html FILE] [--json FILE]"
+        " [--record FILE | --replay FILE] [--profile FILE] [--stats]"
+        " [src [dest]]\n", progname);
 }
 
-typedef void (*Directive_Handler)(Context *ctx, String_View sv);
-typedef struct {
-    String_View open;
-    String_View close;
-    Directive_Handler handler;
-} Directive;
-
-#define DIRECTIVES_COUNT 5
-Directive directives[DIRECTIVES_COUNT] = {
-    // shell
-    {
-        .open = SV_STATIC("$("),
-        .close = SV_STATIC(")"),
-        .handler = preprocess_shell,
-    },
-    // djl-tex
-    {
-        .open = SV_STATIC("$$"),
-        .close = SV_STATIC("$$"),
-        .handler = preprocess_tex,
-    },
-    // title
-    {
-        .open = SV_STATIC("%title "),
-        .handler = preprocess_title,
-    },
-    // meta
-    {
-        .open = SV_STATIC("%meta "),
-        .handler = preprocess_meta,
-    },
-    // head
-    {
-        .open = SV_STATIC("%"),
-        .handler = preprocess_head,
-    },
-};
-
-String_View
-get_enclosed(Directive dir, String_View *sv)
+FILE *
+open_dest(const char *path)
 {
-    size_t index = 0;
-    if (!index_of_delim(*sv, dir.close, &index)) {
-        die("ERROR: Directive " SV_Fmt "..." SV_Fmt " was not closed!\n",
-            SV_Arg(dir.open), SV_Arg(dir.close));
-    }
-
-    String_View content = sv_chop_left(sv, index);
-
-    if (!sv_eq(dir.open, dir.close)) {
-        String_View slice = content;
-        // Nested directive found
-        // TODO: Do we really want to support nesting?
-        while (index_of_delim(slice, dir.open, &index)) {
-            // Find something to close it
-            if (!index_of_delim(*sv, dir.close, &index)) {
-                die("ERROR: Directive " SV_Fmt "..." SV_Fmt " was not closed!\n",
-                            SV_Arg(dir.open), SV_Arg(dir.close));
-            }
-            // Extend cmd to enclose closing delim
-            slice = sv_chop_left(sv, index + dir.close.count);
-            content.count += slice.count;
-        }
+    FILE *dest = fopen(path, "w");
+    if (dest == NULL) {
+        die("ERROR: Unable to open dest file `%s`: %s\n", path,
+            strerror(errno));
     }
-
-    return sv_trim_right(content);
+    return dest;
 }
 
-
-void
-preprocess(Context *ctx)
+// Start the markdown command writing to dest, returning a pipe to it
+FILE *
+open_markdown(FILE *dest)
 {
-    String_View in;
-
-    FILE *src = ctx->src;
-    FILE *dest = ctx->dest;
-
-    while (next_line(&in, src)) {
-        String_View sv = in;
-
-        if (sv_starts_with(sv, SV("    ")) || sv_starts_with(sv, SV("	"))) {
-            ctx->in_code_block = true;
-        } else if (ctx->in_code_block) {
-            ctx->in_code_block = false;
-        }
+    int mdfd[2];
+    if (pipe(mdfd) < 0) {
+        die("ERROR: Unable to create pipes: %s\n", strerror(errno));
+    }
+    // Don't leak our end into other children, or markdown won't see EOF
+    if (fcntl(mdfd[PIPE_WRITE], F_SETFD, FD_CLOEXEC) < 0) {
+        die("ERROR: Unable to set close-on-exec on pipe: %s\n",
+            strerror(errno));
+    }
 
-        // Whole-line directives
-        for (size_t i = 0; i < DIRECTIVES_COUNT; i++) {
-            if (directives[i].close.count != 0) continue;
+    pid_t p = fork();
+    if (p < 0) die("ERROR: Unable to fork: %s\n", strerror(errno));
 
-            if (sv_starts_with(sv, directives[i].open)) {
-                sv_chop_left(&sv, directives[i].open.count);
-                directives[i].handler(ctx, sv);
-                sv.count = 0; // Done parsing this line!
-                break;
-            }
+    if (p == 0) {
+        if (dup2(mdfd[PIPE_READ], fileno(stdin)) < 0) {
+            die("ERROR: Unable to set stdin of child: %s\n",
+                strerror(errno));
         }
-
-        // If we're in a code block we can just print the whole line and be done
-        // with it
-        if (ctx->in_code_block) {
-            fprintf(dest, SV_Fmt, SV_Arg(sv));
-            sv.count = 0;
+        if (close(mdfd[PIPE_READ]) < 0 || close(mdfd[PIPE_WRITE]) < 0) {
+            die("ERROR: Unable to close pipe fd's: %s\n", strerror(errno));
         }
 
-        while (sv.count > 0) {
-            bool processed = false;
-
-            // In-line directives
-            for (size_t i = 0; i < DIRECTIVES_COUNT; i++) {
-                if (directives[i].close.count == 0) continue;
-
-                if (sv_starts_with(sv, directives[i].open)) {
-                    sv_chop_left(&sv, directives[i].open.count);
-                    String_View content = get_enclosed(directives[i], &sv);
-                    directives[i].handler(ctx, content);
-                    sv_chop_left(&sv, directives[i].close.count);
-                    processed = true;
-                    break;
-                }
+        if (fileno(dest) != fileno(stdout)) {
+            if (dup2(fileno(dest), fileno(stdout)) < 0) {
+                die("ERROR: Unable to set stdout of child: %s\n",
+                    strerror(errno));
             }
-
-            if (!processed) {
-                String_View chopped = sv_chop_left(&sv, 1);
-
-                if (sv_eq(chopped, SV("\\"))) {
-                    // Make sure we only unescape if we recognise a directive
-                    // following the backslash
-                    for (size_t i = 0; i < DIRECTIVES_COUNT; i++) {
-                        Directive dir = directives[i];
-                        if (sv_starts_with(sv, dir.open)) {
-                            chopped = sv_chop_left(&sv, dir.open.count);
-                            break;
-                        } else if (dir.close.count && sv_starts_with(sv, dir.close)) {
-                            chopped = sv_chop_left(&sv, dir.close.count);
-                            break;
-                        }
-                    }
-                }
-
-                fprintf(dest, SV_Fmt, SV_Arg(chopped));
+            if (close(fileno(dest)) < 0) {
+                die("ERROR: Unable to close dest fd after dup2: %s\n",
+                    strerror(errno));
             }
         }
+        // TODO: Take markdown command from args
+        char *args[] = { "markdown", NULL };
+        if (execvp(args[0], args) < 0) {
+            die("ERROR: Unable to exec' markdown command: `%s`: %s\n",
+                args[0], strerror(errno));
+        }
+        assert(false && "UNREACHABLE");
+    }
 
-        fputc('\n', dest);
-        free((char*)in.data);
+    // Parent
+    if (close(mdfd[PIPE_READ]) < 0) {
+        die("ERROR: Unable to close pipe: %s\n", strerror(errno));
+    }
+    // markdown owns dest now
+    if (dest != stdout && fclose(dest) != 0) {
+        die("ERROR: Unable to close dest file: %s\n", strerror(errno));
     }
+    FILE *pipe = fdopen(mdfd[PIPE_WRITE], "w");
+    if (pipe == NULL) {
+        die("ERROR: Unable to open FILE to subprocess: %s\n",
+            strerror(errno));
+    }
+    return pipe;
 }
 
 void
-usage(const char *progname)
+add_output(Context *ctx, FILE *dest, bool markdown)
 {
-    die("USAGE: %s [-e] [src [dest]]\n", progname);
+    assert(ctx->outputs_count < MDPP_OUTPUTS_CAP);
+    Output *out = &ctx->outputs[ctx->outputs_count++];
+    out->is_pipe = markdown;
+    out->stream = markdown ? open_markdown(dest) : dest;
+    if (!mdpp_add_output(ctx->mdpp, write_file, out->stream)) {
+        die("ERROR: Too many outputs\n");
+    }
 }
 
-Context
-init(int argc, const char *argv[])
+void
+init(Context *ctx, int argc, const char *argv[])
 {
     const char *progname = argv[0];
     argc -= 1;
     argv += 1;
 
-    Context ctx = {0};
-    ctx.src = stdin;
-    ctx.dest = stdout;
-
-    // Create shell subprocess
-    {
-        int shfd[4];
-        if (pipe(shfd) < 0 || pipe(shfd+2) < 0) {
-            die("ERROR: Unable to create pipes for shell: %s\n",
-                strerror(errno));
-        }
-
-        pid_t p = fork();
-        if (p < 0) die("ERROR: Unable to fork: %s\n", strerror(errno));
-        if (p == 0) {
-            if (dup2(shfd[PIPE_READ], fileno(stdin)) < 0) {
-                die("ERROR: Unable to set stdin in child: %s\n",
-                    strerror(errno));
-            }
-
-            if (dup2(shfd[2+PIPE_WRITE], fileno(stdout)) < 0) {
-                die("ERROR: Unable to set stdout in child: %s\n",
-                    strerror(errno));
-            }
+    ctx->src = stdin;
+    ctx->src_name = "stdin";
+    ctx->mdpp = mdpp_new();
+    if (ctx->mdpp == NULL) die("ERROR: Unable to allocate context\n");
 
-            if (close(shfd[PIPE_READ]) < 0
-                    || close(shfd[PIPE_WRITE]) < 0
-                    || close(shfd[2+PIPE_READ]) < 0
-                    || close(shfd[2+PIPE_WRITE]) < 0) {
-                die("ERROR: Unable to close pipe fd's: %s\n", strerror(errno));
-
-            }
-
-            if (execl("/bin/sh", "/bin/sh", (char*)NULL) < 0) {
-                die("ERROR: Unable to execute shell: %s\n", strerror(errno));
-            }
-
-            assert(false && "UNREACHABLE");
-        } else {
-            if (close(shfd[PIPE_READ]) < 0 || close(shfd[2+PIPE_WRITE])) {
-                die("ERROR: Unable to close pipe fd's: %s\n", strerror(errno));
-            }
-
-            ctx.shell_write = fdopen(shfd[PIPE_WRITE], "w");
-            ctx.shell_read = fdopen(shfd[2+PIPE_READ], "r");
-            if (ctx.shell_write == NULL || ctx.shell_read == NULL) {
-                die("ERROR: Unable to open FILEs from pipes to shell: %s\n",
-                    strerror(errno));
-            }
-        }
-    }
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    mdpp_set_jobs(ctx->mdpp, jobs > 0 ? jobs : 1);
 
     // Flags
     bool flag_e = false;
+    const char *md_paths[MDPP_OUTPUTS_CAP];
+    size_t md_paths_count = 0;
+    const char *html_paths[MDPP_OUTPUTS_CAP];
+    size_t html_paths_count = 0;
     int i;
     for (i = 0; i < argc; i++) {
         if (argv[i][0] != '-') break;
         if (strcmp(argv[i], "-e") == 0) {
             flag_e = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (++i >= argc) usage(progname);
+            char *end;
+            long jobs = strtol(argv[i], &end, 10);
+            if (*end != '\0' || jobs < 1) usage(progname);
+            mdpp_set_jobs(ctx->mdpp, jobs);
+        } else if (strcmp(argv[i], "--chunk-min") == 0) {
+            if (++i >= argc) usage(progname);
+            char *end;
+            long chunk_min = strtol(argv[i], &end, 10);
+            if (*end != '\0' || chunk_min < 1) usage(progname);
+            mdpp_set_chunk_min(ctx->mdpp, chunk_min);
+        } else if (strcmp(argv[i], "--md") == 0) {
+            if (++i >= argc || md_paths_count >= MDPP_OUTPUTS_CAP) {
+                usage(progname);
+            }
+            md_paths[md_paths_count++] = argv[i];
+        } else if (strcmp(argv[i], "--html") == 0) {
+            if (++i >= argc || html_paths_count >= MDPP_OUTPUTS_CAP) {
+                usage(progname);
+            }
+            html_paths[html_paths_count++] = argv[i];
+        } else if (strcmp(argv[i], "--json") == 0) {
+            if (++i >= argc) usage(progname);
+            ctx->json = fopen(argv[i], "w");
+            if (ctx->json == NULL) {
+                die("ERROR: Unable to open json file `%s`: %s\n", argv[i],
+                    strerror(errno));
+            }
+        } else if (strcmp(argv[i], "--record") == 0) {
+            if (++i >= argc) usage(progname);
+            ctx->record.trace = fopen(argv[i], "w");
+            if (ctx->record.trace == NULL) {
+                die("ERROR: Unable to open record file `%s`: %s\n", argv[i],
+                    strerror(errno));
+            }
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            if (++i >= argc) usage(progname);
+            FILE *trace = fopen(argv[i], "r");
+            if (trace == NULL) {
+                die("ERROR: Unable to open replay file `%s`: %s\n", argv[i],
+                    strerror(errno));
+            }
+            ctx->replay.path = argv[i];
+            read_file(trace, argv[i], &ctx->replay.trace);
+            ctx->replay.rest = sv_from_parts(ctx->replay.trace.data,
+                                             ctx->replay.trace.count);
+            fclose(trace);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            ctx->stats = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            if (++i >= argc) usage(progname);
+            ctx->profile = fopen(argv[i], "w");
+            if (ctx->profile == NULL) {
+                die("ERROR: Unable to open profile file `%s`: %s\n", argv[i],
+                    strerror(errno));
+            }
+            mdpp_set_profile(ctx->mdpp, write_file, ctx->profile);
         } else {
             usage(progname);
         }
@@ -394,73 +374,56 @@ init(int argc, const char *argv[])
 
     // Arguments
     if (argc > 2) usage(progname);
+    if (ctx->record.trace != NULL && ctx->replay.path != NULL) usage(progname);
+    if (md_paths_count + html_paths_count + (argc > 1) > MDPP_OUTPUTS_CAP) {
+        usage(progname);
+    }
+    // -e applies to dest, which there is none of with only --md/--html
+    if (flag_e && argc < 2 && md_paths_count + html_paths_count > 0) {
+        usage(progname);
+    }
     if (argc > 0) {
-        ctx.src = fopen(argv[0], "r");
-        if (ctx.src == NULL) {
+        ctx->src = fopen(argv[0], "r");
+        if (ctx->src == NULL) {
             die("ERROR: Unable to open src file `%s`: %s\n", argv[0],
                 strerror(errno));
         }
+        ctx->src_name = argv[0];
     }
 
-    if (argc > 1) {
-        ctx.dest = fopen(argv[1], "w");
-        if (ctx.dest == NULL) {
-            die("ERROR: Unable to open dest file `%s`: %s\n", argv[1],
-                strerror(errno));
+    Mdpp_Shell shell;
+    if (ctx->replay.path != NULL) {
+        // Everything comes from the trace, so there's no need for /bin/sh
+        shell = (Mdpp_Shell) {
+            .user = &ctx->replay,
+            .exec = replay_shell_exec,
+            .set = replay_shell_set,
+        };
+    } else {
+        if (!mdpp_shell_sh_start(&ctx->shell)) {
+            die("ERROR: Unable to start shell: %s\n", strerror(errno));
         }
+        shell = ctx->shell;
     }
 
-    if (flag_e) {
-        assert(ctx.dest != NULL);
-        int mdfd[2];
-        if (pipe(mdfd) < 0) {
-            die("ERROR: Unable to create pipes: %s\n", strerror(errno));
-        }
-
-        pid_t p = fork();
-        if (p < 0) die("ERROR: Unable to fork: %s\n", strerror(errno));
-
-        if (p == 0) {
-            if (dup2(mdfd[PIPE_READ], fileno(stdin)) < 0) {
-                die("ERROR: Unable to set stdin of child: %s\n",
-                    strerror(errno));
-            }
-            if (close(mdfd[PIPE_READ]) < 0 || close(mdfd[PIPE_WRITE]) < 0) {
-                die("ERROR: Unable to close pipe fd's: %s\n", strerror(errno));
-            }
-
-            if (fileno(ctx.dest) != fileno(stdout)) {
-                if (dup2(fileno(ctx.dest), fileno(stdout)) < 0) {
-                    die("ERROR: Unable to set stdout of child: %s\n",
-                        strerror(errno));
-                }
-                if (close(fileno(ctx.dest)) < 0) {
-                    die("ERROR: Unable to close dest fd after dup2: %s\n",
-                        strerror(errno));
-                }
-            }
-            // TODO: Take markdown command from args
-            char *args[] = { "markdown", NULL };
-            if (execvp(args[0], args) < 0) {
-                die("ERROR: Unable to exec' markdown command: `%s`: %s\n",
-                    args[0], strerror(errno));
-            }
-            assert(false && "UNREACHABLE");
-        }
-
-        // Parent
-        if (close(mdfd[PIPE_READ]) < 0) {
-            die("ERROR: Unable to close pipe: %s\n", strerror(errno));
-        }
-        ctx.dest = fdopen(mdfd[PIPE_WRITE], "w");
-        if (ctx.dest == NULL) {
-            die("ERROR: Unable to open FILE to subprocess: %s\n",
-                strerror(errno));
-        }
-        ctx.dest_is_pipe = true;
+    if (ctx->record.trace != NULL) {
+        ctx->record.inner = shell;
+        shell = (Mdpp_Shell) {
+            .user = &ctx->record,
+            .exec = record_shell_exec,
+            .set = record_shell_set,
+        };
     }
+    mdpp_set_shell(ctx->mdpp, shell);
 
-    return ctx;
+    if (argc > 1) add_output(ctx, open_dest(argv[1]), flag_e);
+    for (size_t j = 0; j < md_paths_count; j++) {
+        add_output(ctx, open_dest(md_paths[j]), false);
+    }
+    for (size_t j = 0; j < html_paths_count; j++) {
+        add_output(ctx, open_dest(html_paths[j]), true);
+    }
+    if (ctx->outputs_count == 0) add_output(ctx, stdout, flag_e);
 }
 
 void
@@ -468,24 +431,52 @@ cleanup(Context *ctx)
 {
     fclose(ctx->src);
     ctx->src = NULL;
-    if (ctx->dest_is_pipe) {
-        if (pclose(ctx->dest) < 0) {
-            die("ERROR: Unable to close destination pipe: %s\n",
-                strerror(errno));
+    for (size_t i = 0; i < ctx->outputs_count; i++) {
+        Output *out = &ctx->outputs[i];
+        if (out->is_pipe) {
+            if (pclose(out->stream) < 0) {
+                die("ERROR: Unable to close destination pipe: %s\n",
+                    strerror(errno));
+            }
+        } else {
+            fclose(out->stream);
         }
-    } else {
-        fclose(ctx->dest);
+        out->stream = NULL;
     }
-    ctx->dest = NULL;
+    ctx->outputs_count = 0;
 
-    if (pclose(ctx->shell_write) < 0) {
-        die("ERROR: Unable to close shell_write pipe: %s\n",
-            strerror(errno));
+    if (ctx->json != NULL) {
+        if (!mdpp_write_json(ctx->mdpp, write_file, ctx->json)) {
+            die("ERROR: Unable to write json: %s\n", strerror(errno));
+        }
+        fclose(ctx->json);
+        ctx->json = NULL;
     }
 
-    if (pclose(ctx->shell_read) < 0) {
-        die("ERROR: Unable to close shell_read pipe: %s\n",
-            strerror(errno));
+    if (ctx->profile != NULL) {
+        fclose(ctx->profile);
+        ctx->profile = NULL;
+    }
+
+    if (ctx->stats) {
+        Mdpp_Stats stats = mdpp_stats(ctx->mdpp);
+        fprintf(stderr, "%zu lines, %zu allocations (%zu after the first line)"
+                ", %zu lexing\n", stats.lines, stats.allocations,
+                stats.allocations - stats.warmup_allocations,
+                stats.lex_allocations);
+    }
+
+    mdpp_free(ctx->mdpp);
+    ctx->mdpp = NULL;
+
+    if (ctx->record.trace != NULL) {
+        fclose(ctx->record.trace);
+        ctx->record.trace = NULL;
+    }
+    mdpp_buffer_free(&ctx->replay.trace);
+
+    if (ctx->shell.user != NULL && !mdpp_shell_sh_stop(&ctx->shell)) {
+        die("ERROR: Unable to stop shell: %s\n", strerror(errno));
     }
 
     // Wait for all children to finish
@@ -496,8 +487,20 @@ cleanup(Context *ctx)
 int
 main(int argc, const char *argv[])
 {
-    Context ctx = init(argc, argv);
-    preprocess(&ctx);
+    Context ctx = {0};
+    init(&ctx, argc, argv);
+
+    Mdpp_Buffer src = {0};
+    read_file(ctx.src, ctx.src_name, &src);
+    if (!mdpp_process(ctx.mdpp, ctx.src_name, src.data, src.count)) {
+        die("ERROR: %s\n", mdpp_error(ctx.mdpp));
+    }
+    // Frames left over mean the document no longer matches its trace
+    if (ctx.replay.rest.count > 0) {
+        die("ERROR: Trace `%s` has frames the document didn't use\n",
+            ctx.replay.path);
+    }
+    mdpp_buffer_free(&src);
+
     cleanup(&ctx);
 }
-
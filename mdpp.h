@@ -0,0 +1,1253 @@
+// mdpp - Markdown preprocessor library
+//
+// Define MDPP_IMPLEMENTATION in exactly one C file before including this
+// header to get the implementation (along with a private copy of sv.h's).
+// It can also be built as C++ by compilers which accept C99's compound
+// literals and flexible array members as extensions, like g++ and clang++.
+//
+// USAGE:
+//   Mdpp *mdpp = mdpp_new();
+//   Mdpp_Shell shell;
+//   if (!mdpp_shell_sh_start(&shell)) ...
+//   mdpp_set_shell(mdpp, shell);
+//   Mdpp_Buffer out = {0};
+//   mdpp_add_output(mdpp, mdpp_buffer_write, &out);
+//   if (!mdpp_process(mdpp, "page.md", src, src_count)) {
+//       fprintf(stderr, "ERROR: %s\n", mdpp_error(mdpp));
+//   }
+//   mdpp_buffer_free(&out);
+//   mdpp_free(mdpp);
+//   mdpp_shell_sh_stop(&shell);
+
+#ifndef MDPP_H_
+#define MDPP_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef MDPPDEF
+#define MDPPDEF
+#endif // MDPPDEF
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Mdpp Mdpp;
+
+// Receives count bytes of output, returns false on failure
+typedef bool (*Mdpp_Write)(void *user, const char *data, size_t count);
+
+// Growable buffer, pass mdpp_buffer_write() and a pointer to one of these to
+// mdpp_add_output() to collect output in memory
+typedef struct {
+    char *data;
+    size_t count;
+    size_t capacity;
+} Mdpp_Buffer;
+
+// Runs the commands of $(...) directives and receives the values of %title and
+// %meta directives. Functions return false on failure.
+typedef struct {
+    void *user;
+    // Run command, setting result to the first line it printed (without the
+    // trailing newline). The result must stay valid until the end of the
+    // current line, which memory from mdpp_alloc() does.
+    bool (*exec)(void *user, Mdpp *mdpp, const char *command, size_t count,
+                 const char **result, size_t *result_count);
+    // Set the variable name to val
+    bool (*set)(void *user, Mdpp *mdpp, const char *name, size_t name_count,
+                const char *val, size_t val_count);
+} Mdpp_Shell;
+
+typedef struct {
+    size_t lines;
+    // Number of calls to malloc (and friends) made executing documents, and
+    // how many of those were made by the end of the first line processed
+    size_t allocations;
+    size_t warmup_allocations;
+    // Number made growing token arrays, which happens before any line runs
+    size_t lex_allocations;
+} Mdpp_Stats;
+
+#define MDPP_OUTPUTS_CAP 8
+#define MDPP_JOBS_CAP 64
+
+MDPPDEF Mdpp *mdpp_new(void);
+MDPPDEF void mdpp_free(Mdpp *mdpp);
+MDPPDEF void mdpp_set_shell(Mdpp *mdpp, Mdpp_Shell shell);
+MDPPDEF bool mdpp_add_output(Mdpp *mdpp, Mdpp_Write write, void *user);
+// Write the time spent on each line and directive as folded stacks
+MDPPDEF void mdpp_set_profile(Mdpp *mdpp, Mdpp_Write write, void *user);
+// Number of threads used to lex large documents (1 by default)
+MDPPDEF void mdpp_set_jobs(Mdpp *mdpp, size_t jobs);
+// Smallest chunk (in bytes) worth lexing on its own thread, MDPP_CHUNK_MIN by
+// default. Mostly useful to exercise chunking in tests.
+MDPPDEF void mdpp_set_chunk_min(Mdpp *mdpp, size_t chunk_min);
+// Preprocess a whole document, name is only used for profiling
+MDPPDEF bool mdpp_process(Mdpp *mdpp, const char *name, const char *data,
+                          size_t count);
+MDPPDEF const char *mdpp_error(const Mdpp *mdpp);
+// Write the %title and %meta values of the last document as JSON
+MDPPDEF bool mdpp_write_json(Mdpp *mdpp, Mdpp_Write write, void *user);
+// Allocate memory which is valid until the end of the current line
+MDPPDEF void *mdpp_alloc(Mdpp *mdpp, size_t size);
+MDPPDEF Mdpp_Stats mdpp_stats(const Mdpp *mdpp);
+MDPPDEF bool mdpp_buffer_write(void *user, const char *data, size_t count);
+MDPPDEF void mdpp_buffer_free(Mdpp_Buffer *buf);
+// Shell backend running commands in a persistent /bin/sh subprocess, so
+// variables and functions carry over between directives. Both return false
+// (with errno set) on failure.
+MDPPDEF bool mdpp_shell_sh_start(Mdpp_Shell *shell);
+MDPPDEF bool mdpp_shell_sh_stop(Mdpp_Shell *shell);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MDPP_H_
+
+#ifdef MDPP_IMPLEMENTATION
+
+#include <stdio.h>
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// sv.h's implementation is compiled in with internal linkage, so it doesn't
+// clash with other copies of it in the program. Define
+// MDPP_NO_SV_IMPLEMENTATION to use the one from elsewhere instead.
+#ifndef MDPP_NO_SV_IMPLEMENTATION
+#ifdef SV_H_
+#error "sv.h must be included after mdpp.h's implementation"
+#endif // SV_H_
+#undef SVDEF
+#define SVDEF static inline
+#define SV_IMPLEMENTATION
+#endif // MDPP_NO_SV_IMPLEMENTATION
+#include "sv.h"
+
+// Transient storage is handed out from regions which are kept across resets,
+// so once warmed up allocating from the arena doesn't touch malloc
+typedef struct Region Region;
+struct Region {
+    Region *next;
+    size_t count;
+    size_t capacity;
+    char data[];
+};
+
+#define REGION_DEFAULT_CAPACITY (8*1024)
+
+typedef struct {
+    Region *begin;
+    Region *end;
+    size_t allocations;
+} Arena;
+
+typedef struct {
+    Mdpp_Write write;
+    void *user;
+} Mdpp_Output;
+
+// %meta values of the document, in the order they were first defined
+typedef struct Meta Meta;
+struct Meta {
+    Meta *next;
+    String_View name;
+    String_View val;
+};
+
+// A frame of the profiler stack, printed as prefix + text + suffix
+typedef struct {
+    String_View prefix;
+    String_View text;
+    String_View suffix;
+    uint64_t start;
+    uint64_t children;
+} Profile_Frame;
+
+#define PROFILE_STACK_CAP 8
+
+typedef enum {
+    TOKEN_TEXT,
+    TOKEN_DIRECTIVE,
+    // Directive which was never closed, processing stops here
+    TOKEN_UNCLOSED,
+} Token_Kind;
+
+typedef struct {
+    Token_Kind kind;
+    size_t directive;
+    // Line within the chunk the token starts on, counting from 0
+    size_t line;
+    // Text to output or the directive's content
+    String_View sv;
+} Token;
+
+// Documents are split at line boundaries into chunks which are lexed in
+// parallel, then their tokens are executed in order
+#ifndef MDPP_CHUNK_MIN
+#define MDPP_CHUNK_MIN (1024*1024)
+#endif // MDPP_CHUNK_MIN
+
+// Used to grow each chunk's tokens, e.g. swap it out to test running out of
+// memory part way through a document
+#ifndef MDPP_REALLOC
+#define MDPP_REALLOC realloc
+#endif // MDPP_REALLOC
+
+typedef struct {
+    String_View src;
+    Token *tokens;
+    size_t tokens_count;
+    size_t tokens_capacity;
+    size_t lines;
+    size_t allocations;
+    bool out_of_memory;
+    // Don't merge text across lines, so every line is attributed its own time
+    // when profiling
+    bool split_lines;
+} Chunk;
+
+struct Mdpp {
+    // Every output receives the same preprocessed text
+    Mdpp_Output outputs[MDPP_OUTPUTS_CAP];
+    size_t outputs_count;
+    Mdpp_Shell shell;
+
+    // Kept across documents so their tokens don't need to be reallocated
+    Chunk chunks[MDPP_JOBS_CAP];
+    size_t jobs;
+    size_t chunk_min;
+
+    bool header_is_open;
+
+    // Shell results and handler scratch, reset at the start of a line
+    Arena arena;
+    // Storage which lives for the whole document (%title and %meta values)
+    Arena doc_arena;
+
+    String_View title;
+    bool has_title;
+    Meta *meta_first;
+    Meta *meta_last;
+
+    // Profiling, disabled when profile is NULL
+    Mdpp_Write profile;
+    void *profile_user;
+    String_View name;
+    size_t line;
+    char line_label[32];
+    Profile_Frame frames[PROFILE_STACK_CAP];
+    size_t frames_count;
+
+    size_t lines;
+    bool warmed_up;
+    size_t warmup_allocations;
+
+    bool failed;
+    char error[256];
+};
+
+static void
+mdpp_fail(Mdpp *ctx, const char *fmt, ...)
+{
+    // Keep the first error, it's the one which caused the others
+    if (ctx->failed) return;
+    ctx->failed = true;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(ctx->error, sizeof(ctx->error), fmt, ap);
+    va_end(ap);
+}
+
+static void *
+arena_alloc(Arena *a, size_t size)
+{
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    while (a->end != NULL && a->end->count + size > a->end->capacity
+            && a->end->next != NULL) {
+        a->end = a->end->next;
+    }
+
+    if (a->end == NULL || a->end->count + size > a->end->capacity) {
+        size_t capacity = size > REGION_DEFAULT_CAPACITY
+            ? size : REGION_DEFAULT_CAPACITY;
+        Region *r = (Region*)malloc(sizeof(*r) + capacity);
+        if (r == NULL) return NULL;
+        a->allocations += 1;
+        r->next = NULL;
+        r->count = 0;
+        r->capacity = capacity;
+
+        if (a->end == NULL) {
+            a->begin = r;
+        } else {
+            a->end->next = r;
+        }
+        a->end = r;
+    }
+
+    void *result = &a->end->data[a->end->count];
+    a->end->count += size;
+    return result;
+}
+
+static bool
+arena_sv_dup(Arena *a, String_View sv, String_View *dup)
+{
+    char *data = (char*)arena_alloc(a, sv.count);
+    if (data == NULL) return false;
+    memcpy(data, sv.data, sv.count);
+    *dup = sv_from_parts(data, sv.count);
+    return true;
+}
+
+static void
+arena_reset(Arena *a)
+{
+    for (Region *r = a->begin; r != NULL; r = r->next) {
+        r->count = 0;
+    }
+    a->end = a->begin;
+}
+
+static void
+arena_free(Arena *a)
+{
+    Region *r = a->begin;
+    while (r != NULL) {
+        Region *next = r->next;
+        free(r);
+        r = next;
+    }
+    a->begin = NULL;
+    a->end = NULL;
+}
+
+static uint64_t
+now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+profile_push(Mdpp *ctx, String_View prefix, String_View text,
+             String_View suffix)
+{
+    if (ctx->profile == NULL) return;
+    assert(ctx->frames_count < PROFILE_STACK_CAP);
+
+    Profile_Frame *frame = &ctx->frames[ctx->frames_count++];
+    frame->prefix = prefix;
+    frame->text = text;
+    frame->suffix = suffix;
+    frame->children = 0;
+    frame->start = now_nsec();
+}
+
+static char *
+profile_write_name(char *out, String_View sv)
+{
+    // ';' separates frames and newlines separate stacks in the folded format
+    for (size_t i = 0; i < sv.count; i++) {
+        char c = sv.data[i];
+        if (c == ';') c = ':';
+        else if (c == '\n' || c == '\t') c = ' ';
+        *out++ = c;
+    }
+    return out;
+}
+
+// Pop the top frame, writing its self time as a folded stack:
+//   doc;line 3;$(echo hi);shell_exec 12345
+static void
+profile_pop(Mdpp *ctx)
+{
+    if (ctx->profile == NULL) return;
+    assert(ctx->frames_count > 0);
+
+    Profile_Frame *frame = &ctx->frames[--ctx->frames_count];
+    uint64_t elapsed = now_nsec() - frame->start;
+    if (ctx->frames_count > 0) {
+        ctx->frames[ctx->frames_count - 1].children += elapsed;
+    }
+
+    char count[32];
+    int count_len = snprintf(count, sizeof(count), " %llu\n",
+                             (unsigned long long)(elapsed - frame->children));
+
+    size_t size = count_len;
+    for (size_t i = 0; i <= ctx->frames_count; i++) {
+        size += 1 + ctx->frames[i].prefix.count + ctx->frames[i].text.count
+            + ctx->frames[i].suffix.count;
+    }
+    char *line = (char*)arena_alloc(&ctx->arena, size);
+    if (line == NULL) {
+        mdpp_fail(ctx, "Unable to allocate profile output");
+        return;
+    }
+
+    char *end = line;
+    for (size_t i = 0; i <= ctx->frames_count; i++) {
+        if (i > 0) *end++ = ';';
+        end = profile_write_name(end, ctx->frames[i].prefix);
+        end = profile_write_name(end, ctx->frames[i].text);
+        end = profile_write_name(end, ctx->frames[i].suffix);
+    }
+    memcpy(end, count, count_len);
+    end += count_len;
+
+    if (!ctx->profile(ctx->profile_user, line, end - line)) {
+        mdpp_fail(ctx, "Unable to write profile output");
+    }
+}
+
+static size_t
+exec_allocations(const Mdpp *ctx)
+{
+    return ctx->arena.allocations + ctx->doc_arena.allocations;
+}
+
+static size_t
+lex_allocations(const Mdpp *ctx)
+{
+    size_t allocations = 0;
+    for (size_t i = 0; i < MDPP_JOBS_CAP; i++) {
+        allocations += ctx->chunks[i].allocations;
+    }
+    return allocations;
+}
+
+// Write to every output
+static void
+emit(Mdpp *ctx, String_View sv)
+{
+    if (ctx->failed) return;
+    for (size_t i = 0; i < ctx->outputs_count; i++) {
+        Mdpp_Output *out = &ctx->outputs[i];
+        if (!out->write(out->user, sv.data, sv.count)) {
+            mdpp_fail(ctx, "Unable to write output");
+            return;
+        }
+    }
+}
+
+static bool
+shell_exec(Mdpp *ctx, String_View command, String_View *result)
+{
+    if (ctx->shell.exec == NULL) {
+        mdpp_fail(ctx, "No shell to run `" SV_Fmt "`", SV_Arg(command));
+        return false;
+    }
+
+    profile_push(ctx, SV_NULL, SV("shell_exec"), SV_NULL);
+    const char *data = NULL;
+    size_t count = 0;
+    bool ok = ctx->shell.exec(ctx->shell.user, ctx, command.data,
+                              command.count, &data, &count);
+    profile_pop(ctx);
+
+    if (!ok) {
+        mdpp_fail(ctx, "Shell command `" SV_Fmt "` failed", SV_Arg(command));
+        return false;
+    }
+    *result = sv_from_parts(data, count);
+    return true;
+}
+
+static bool
+shell_set(Mdpp *ctx, String_View name, String_View val)
+{
+    if (ctx->shell.set == NULL) {
+        mdpp_fail(ctx, "No shell to set `" SV_Fmt "`", SV_Arg(name));
+        return false;
+    }
+
+    profile_push(ctx, SV_NULL, SV("shell_set"), SV_NULL);
+    bool ok = ctx->shell.set(ctx->shell.user, ctx, name.data, name.count,
+                             val.data, val.count);
+    profile_pop(ctx);
+
+    if (!ok) {
+        mdpp_fail(ctx, "Unable to set `" SV_Fmt "` in shell", SV_Arg(name));
+    }
+    return ok;
+}
+
+static bool
+index_of_delim(String_View sv, String_View delim, size_t *index)
+{
+    // Could not find
+    size_t n = 0;
+    if (!sv_find(sv, delim, &n)) return false;
+
+    // Found an escaped occurence
+    if (n > 0 && *(sv.data + n - 1) == '\\') {
+        n += delim.count;
+        sv_chop_left(&sv, n);
+
+        size_t nindex = 0;
+        if (!index_of_delim(sv, delim, &nindex)) return false;
+
+        if (index) *index = n + nindex;
+        return true;
+    }
+
+    if (index) *index = n;
+    return true;
+}
+
+static void
+preprocess_shell(Mdpp *ctx, String_View sv)
+{
+    String_View result;
+    if (!shell_exec(ctx, sv, &result)) return;
+    emit(ctx, result);
+}
+
+static void
+preprocess_tex(Mdpp *ctx, String_View sv)
+{
+    emit(ctx, SV("<djl-tex>"));
+    emit(ctx, sv);
+    emit(ctx, SV("</djl-tex>"));
+}
+
+static void
+preprocess_head(Mdpp *ctx, String_View sv)
+{
+    ctx->header_is_open = !ctx->header_is_open;
+    emit(ctx, ctx->header_is_open ? SV("<head>") : SV("</head>"));
+    (void)sv;
+}
+
+static void
+preprocess_title(Mdpp *ctx, String_View sv)
+{
+    emit(ctx, SV("<title>"));
+    emit(ctx, sv);
+    emit(ctx, SV("</title>"));
+    // Set $title in shell
+    if (!shell_set(ctx, SV("title"), sv)) return;
+
+    if (!arena_sv_dup(&ctx->doc_arena, sv, &ctx->title)) {
+        mdpp_fail(ctx, "Unable to allocate %%title");
+        return;
+    }
+    ctx->has_title = true;
+}
+
+static void
+preprocess_meta(Mdpp *ctx, String_View sv)
+{
+    // TODO: Support spaces
+    size_t n = 0;
+    sv_index_of(sv, ' ', &n);
+    if (!n) {
+        mdpp_fail(ctx, "%%meta directive requires two arguments");
+        return;
+    }
+    String_View name = sv_chop_left(&sv, n);
+    String_View val = sv_trim(sv);
+
+    emit(ctx, SV("<meta name=\""));
+    emit(ctx, name);
+    emit(ctx, SV("\" content=\""));
+    emit(ctx, val);
+    emit(ctx, SV("\">"));
+    if (!shell_set(ctx, name, val)) return;
+
+    // Redefinitions replace the value, just like they do in the shell
+    Meta *meta = ctx->meta_first;
+    while (meta != NULL && !sv_eq(meta->name, name)) meta = meta->next;
+    if (meta == NULL) {
+        meta = (Meta*)arena_alloc(&ctx->doc_arena, sizeof(*meta));
+        if (meta == NULL || !arena_sv_dup(&ctx->doc_arena, name, &meta->name)) {
+            mdpp_fail(ctx, "Unable to allocate %%meta");
+            return;
+        }
+        meta->next = NULL;
+        meta->val = SV_NULL;
+        if (ctx->meta_last) ctx->meta_last->next = meta;
+        else ctx->meta_first = meta;
+        ctx->meta_last = meta;
+    }
+    if (!arena_sv_dup(&ctx->doc_arena, val, &meta->val)) {
+        mdpp_fail(ctx, "Unable to allocate %%meta");
+    }
+}
+
+typedef void (*Directive_Handler)(Mdpp *ctx, String_View sv);
+typedef struct {
+    String_View open;
+    String_View close;
+    Directive_Handler handler;
+} Directive;
+
+#define DIRECTIVES_COUNT 5
+static Directive directives[DIRECTIVES_COUNT] = {
+    // shell
+    {
+        .open = SV_STATIC("$("),
+        .close = SV_STATIC(")"),
+        .handler = preprocess_shell,
+    },
+    // djl-tex
+    {
+        .open = SV_STATIC("$$"),
+        .close = SV_STATIC("$$"),
+        .handler = preprocess_tex,
+    },
+    // title
+    {
+        .open = SV_STATIC("%title "),
+        .handler = preprocess_title,
+    },
+    // meta
+    {
+        .open = SV_STATIC("%meta "),
+        .handler = preprocess_meta,
+    },
+    // head
+    {
+        .open = SV_STATIC("%"),
+        .handler = preprocess_head,
+    },
+};
+
+static bool
+get_enclosed(Directive dir, String_View *sv, String_View *enclosed)
+{
+    size_t index = 0;
+    if (!index_of_delim(*sv, dir.close, &index)) return false;
+
+    String_View content = sv_chop_left(sv, index);
+
+    if (!sv_eq(dir.open, dir.close)) {
+        String_View slice = content;
+        // Nested directive found
+        // TODO: Do we really want to support nesting?
+        while (index_of_delim(slice, dir.open, &index)) {
+            // Find something to close it
+            if (!index_of_delim(*sv, dir.close, &index)) return false;
+            // Extend cmd to enclose closing delim
+            slice = sv_chop_left(sv, index + dir.close.count);
+            content.count += slice.count;
+        }
+    }
+
+    *enclosed = sv_trim_right(content);
+    return true;
+}
+
+static void
+run_directive(Mdpp *ctx, Directive dir, String_View content)
+{
+    profile_push(ctx, dir.open, content, dir.close);
+    dir.handler(ctx, content);
+    profile_pop(ctx);
+}
+
+static bool
+chunk_push(Chunk *c, Token token)
+{
+    if (c->tokens_count >= c->tokens_capacity) {
+        size_t capacity = c->tokens_capacity ? c->tokens_capacity * 2 : 64;
+        Token *tokens = (Token*)MDPP_REALLOC(c->tokens,
+                                             capacity * sizeof(*tokens));
+        if (tokens == NULL) {
+            c->out_of_memory = true;
+            return false;
+        }
+        c->allocations += 1;
+        c->tokens = tokens;
+        c->tokens_capacity = capacity;
+    }
+    c->tokens[c->tokens_count++] = token;
+    return true;
+}
+
+// Text which directly follows the previous text in the source is merged into
+// it, so runs of plain lines become a single token
+static bool
+lex_text(Chunk *c, size_t line, String_View sv)
+{
+    if (c->tokens_count > 0) {
+        Token *last = &c->tokens[c->tokens_count - 1];
+        if (last->kind == TOKEN_TEXT && last->sv.data + last->sv.count == sv.data
+                && (!c->split_lines || last->line == line)) {
+            last->sv.count += sv.count;
+            return true;
+        }
+    }
+    return chunk_push(c, (Token) {
+        .kind = TOKEN_TEXT,
+        .line = line,
+        .sv = sv,
+    });
+}
+
+static bool
+lex_directive(Chunk *c, size_t line, size_t directive, String_View sv)
+{
+    return chunk_push(c, (Token) {
+        .kind = TOKEN_DIRECTIVE,
+        .directive = directive,
+        .line = line,
+        .sv = sv,
+    });
+}
+
+static bool
+may_open_inline(char c)
+{
+    if (c == '\\') return true;
+    for (size_t i = 0; i < DIRECTIVES_COUNT; i++) {
+        if (directives[i].close.count != 0 && directives[i].open.data[0] == c) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns false when lexing should stop
+static bool
+lex_line(Chunk *c, size_t line, String_View sv, String_View newline)
+{
+    // Whether we're in a code block only depends on the line itself, so
+    // chunks don't need any state from the ones before them
+    bool in_code_block = sv_starts_with(sv, SV("    "))
+        || sv_starts_with(sv, SV("	"));
+
+    // Whole-line directives
+    for (size_t i = 0; i < DIRECTIVES_COUNT; i++) {
+        if (directives[i].close.count != 0) continue;
+
+        if (sv_starts_with(sv, directives[i].open)) {
+            sv_chop_left(&sv, directives[i].open.count);
+            if (!lex_directive(c, line, i, sv)) return false;
+            sv.count = 0; // Done parsing this line!
+            break;
+        }
+    }
+
+    // If we're in a code block we can just print the whole line and be done
+    // with it
+    if (in_code_block) {
+        if (!lex_text(c, line, sv)) return false;
+        sv.count = 0;
+    }
+
+    while (sv.count > 0) {
+        bool processed = false;
+
+        // In-line directives
+        for (size_t i = 0; i < DIRECTIVES_COUNT; i++) {
+            if (directives[i].close.count == 0) continue;
+
+            if (sv_starts_with(sv, directives[i].open)) {
+                sv_chop_left(&sv, directives[i].open.count);
+                String_View content;
+                if (!get_enclosed(directives[i], &sv, &content)) {
+                    chunk_push(c, (Token) {
+                        .kind = TOKEN_UNCLOSED,
+                        .directive = i,
+                        .line = line,
+                    });
+                    return false;
+                }
+                if (!lex_directive(c, line, i, content)) return false;
+                sv_chop_left(&sv, directives[i].close.count);
+                processed = true;
+                break;
+            }
+        }
+
+        if (!processed) {
+            String_View chopped = sv_chop_left(&sv, 1);
+
+            if (!sv_eq(chopped, SV("\\"))) {
+                // Take everything up to where the next directive could start
+                size_t n = 0;
+                while (n < sv.count && !may_open_inline(sv.data[n])) n++;
+                chopped.count += sv_chop_left(&sv, n).count;
+            } else {
+                // Make sure we only unescape if we recognise a directive
+                // following the backslash
+                for (size_t i = 0; i < DIRECTIVES_COUNT; i++) {
+                    Directive dir = directives[i];
+                    if (sv_starts_with(sv, dir.open)) {
+                        chopped = sv_chop_left(&sv, dir.open.count);
+                        break;
+                    } else if (dir.close.count && sv_starts_with(sv, dir.close)) {
+                        chopped = sv_chop_left(&sv, dir.close.count);
+                        break;
+                    }
+                }
+            }
+
+            if (!lex_text(c, line, chopped)) return false;
+        }
+    }
+
+    return lex_text(c, line, newline);
+}
+
+static void *
+lex_chunk(void *arg)
+{
+    Chunk *c = (Chunk*)arg;
+    c->tokens_count = 0;
+    c->lines = 0;
+    c->out_of_memory = false;
+
+    String_View src = c->src;
+    while (src.count > 0) {
+        String_View raw = sv_chop_by_delim(&src, '\n');
+        String_View line = sv_trim_right(raw);
+
+        // Use the newline from the source when it directly follows the line,
+        // so it can be merged into the text before it
+        bool had_newline = src.data != raw.data + raw.count;
+        String_View newline = had_newline && line.count == raw.count
+            ? sv_from_parts(raw.data + raw.count, 1)
+            : SV("\n");
+
+        if (!lex_line(c, c->lines, line, newline)) break;
+        c->lines += 1;
+    }
+    return NULL;
+}
+
+static size_t
+split_chunks(Mdpp *ctx, String_View src)
+{
+    size_t jobs = src.count / ctx->chunk_min;
+    if (jobs > ctx->jobs) jobs = ctx->jobs;
+    if (jobs < 1) jobs = 1;
+
+    size_t count = 0;
+    while (src.count > 0) {
+        size_t size = src.count;
+        if (count + 1 < jobs) {
+            // Extend the chunk to the end of the line it stops in
+            size = src.count / (jobs - count);
+            const char *nl = (const char*)memchr(src.data + size, '\n',
+                                                 src.count - size);
+            if (nl != NULL) size = nl - src.data + 1;
+            else size = src.count;
+        }
+        ctx->chunks[count].split_lines = ctx->profile != NULL;
+        ctx->chunks[count++].src = sv_chop_left(&src, size);
+    }
+    return count;
+}
+
+static void
+lex(Mdpp *ctx, size_t chunks_count)
+{
+    pthread_t threads[MDPP_JOBS_CAP];
+    bool started[MDPP_JOBS_CAP] = {0};
+    for (size_t i = 1; i < chunks_count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, lex_chunk,
+                                    &ctx->chunks[i]) == 0;
+    }
+
+    lex_chunk(&ctx->chunks[0]);
+    for (size_t i = 1; i < chunks_count; i++) {
+        // Fall back to lexing it ourselves if we couldn't start a thread
+        if (started[i]) pthread_join(threads[i], NULL);
+        else lex_chunk(&ctx->chunks[i]);
+    }
+}
+
+static void
+begin_line(Mdpp *ctx, size_t line)
+{
+    arena_reset(&ctx->arena);
+    ctx->line = line;
+    if (ctx->profile != NULL) {
+        snprintf(ctx->line_label, sizeof(ctx->line_label), "line %zu",
+                 ctx->line);
+        profile_push(ctx, SV_NULL, sv_from_cstr(ctx->line_label), SV_NULL);
+    }
+}
+
+static void
+end_line(Mdpp *ctx)
+{
+    profile_pop(ctx);
+    if (!ctx->warmed_up) {
+        ctx->warmup_allocations = exec_allocations(ctx);
+        ctx->warmed_up = true;
+    }
+}
+
+// Execute the tokens of every chunk in order
+static void
+execute(Mdpp *ctx, size_t chunks_count)
+{
+    size_t line = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < chunks_count && !ctx->failed; i++) {
+        Chunk *c = &ctx->chunks[i];
+        for (size_t j = 0; j < c->tokens_count && !ctx->failed; j++) {
+            Token *token = &c->tokens[j];
+            if (offset + token->line + 1 != line) {
+                if (line != 0) end_line(ctx);
+                line = offset + token->line + 1;
+                begin_line(ctx, line);
+            }
+
+            Directive dir = directives[token->directive];
+            switch (token->kind) {
+            case TOKEN_TEXT:
+                emit(ctx, token->sv);
+                break;
+            case TOKEN_DIRECTIVE:
+                run_directive(ctx, dir, token->sv);
+                break;
+            case TOKEN_UNCLOSED:
+                mdpp_fail(ctx, "Directive " SV_Fmt "..." SV_Fmt " was not closed!",
+                          SV_Arg(dir.open), SV_Arg(dir.close));
+                break;
+            }
+        }
+
+        if (c->out_of_memory) mdpp_fail(ctx, "Unable to allocate tokens");
+        offset += c->lines;
+    }
+    if (line != 0) end_line(ctx);
+    ctx->lines += offset;
+}
+
+MDPPDEF Mdpp *
+mdpp_new(void)
+{
+    Mdpp *mdpp = (Mdpp*)calloc(1, sizeof(Mdpp));
+    if (mdpp != NULL) {
+        mdpp->jobs = 1;
+        mdpp->chunk_min = MDPP_CHUNK_MIN;
+    }
+    return mdpp;
+}
+
+MDPPDEF void
+mdpp_free(Mdpp *mdpp)
+{
+    if (mdpp == NULL) return;
+    for (size_t i = 0; i < MDPP_JOBS_CAP; i++) {
+        free(mdpp->chunks[i].tokens);
+    }
+    arena_free(&mdpp->arena);
+    arena_free(&mdpp->doc_arena);
+    free(mdpp);
+}
+
+MDPPDEF void
+mdpp_set_shell(Mdpp *mdpp, Mdpp_Shell shell)
+{
+    mdpp->shell = shell;
+}
+
+MDPPDEF bool
+mdpp_add_output(Mdpp *mdpp, Mdpp_Write write, void *user)
+{
+    if (mdpp->outputs_count >= MDPP_OUTPUTS_CAP) return false;
+    mdpp->outputs[mdpp->outputs_count++] = (Mdpp_Output) {
+        .write = write,
+        .user = user,
+    };
+    return true;
+}
+
+MDPPDEF void
+mdpp_set_profile(Mdpp *mdpp, Mdpp_Write write, void *user)
+{
+    mdpp->profile = write;
+    mdpp->profile_user = user;
+}
+
+MDPPDEF void
+mdpp_set_jobs(Mdpp *mdpp, size_t jobs)
+{
+    if (jobs < 1) jobs = 1;
+    if (jobs > MDPP_JOBS_CAP) jobs = MDPP_JOBS_CAP;
+    mdpp->jobs = jobs;
+}
+
+MDPPDEF void
+mdpp_set_chunk_min(Mdpp *mdpp, size_t chunk_min)
+{
+    mdpp->chunk_min = chunk_min < 1 ? 1 : chunk_min;
+}
+
+MDPPDEF bool
+mdpp_process(Mdpp *mdpp, const char *name, const char *data, size_t count)
+{
+    // Start a new document
+    mdpp->header_is_open = false;
+    mdpp->has_title = false;
+    mdpp->title = SV_NULL;
+    mdpp->meta_first = NULL;
+    mdpp->meta_last = NULL;
+    arena_reset(&mdpp->doc_arena);
+    mdpp->name = sv_from_cstr(name);
+    mdpp->line = 0;
+    mdpp->frames_count = 0;
+    mdpp->failed = false;
+    mdpp->error[0] = '\0';
+
+    String_View src = sv_from_parts(data, count);
+
+    profile_push(mdpp, SV_NULL, mdpp->name, SV_NULL);
+    profile_push(mdpp, SV_NULL, SV("lex"), SV_NULL);
+    size_t chunks_count = split_chunks(mdpp, src);
+    lex(mdpp, chunks_count);
+    profile_pop(mdpp);
+    execute(mdpp, chunks_count);
+    profile_pop(mdpp);
+
+    return !mdpp->failed;
+}
+
+MDPPDEF const char *
+mdpp_error(const Mdpp *mdpp)
+{
+    return mdpp->error;
+}
+
+static bool
+json_write_string(Mdpp_Write write, void *user, String_View sv)
+{
+    if (!write(user, "\"", 1)) return false;
+    while (sv.count > 0) {
+        // Write everything up to the next character which needs escaping
+        size_t n = 0;
+        while (n < sv.count && sv.data[n] != '"' && sv.data[n] != '\\'
+                && (unsigned char)sv.data[n] >= 0x20) {
+            n++;
+        }
+        String_View plain = sv_chop_left(&sv, n);
+        if (plain.count > 0 && !write(user, plain.data, plain.count)) {
+            return false;
+        }
+        if (sv.count == 0) break;
+
+        char escaped[8];
+        unsigned char c = sv_chop_left(&sv, 1).data[0];
+        int len = (c == '"' || c == '\\')
+            ? snprintf(escaped, sizeof(escaped), "\\%c", c)
+            : snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        if (!write(user, escaped, len)) return false;
+    }
+    return write(user, "\"", 1);
+}
+
+// e.g. {"title": "Hello", "meta": {"author": "Dylan Lom"}}
+MDPPDEF bool
+mdpp_write_json(Mdpp *mdpp, Mdpp_Write write, void *user)
+{
+#define JSON_LIT(lit) write(user, lit, sizeof(lit) - 1)
+    if (!JSON_LIT("{\"title\": ")) return false;
+    if (mdpp->has_title) {
+        if (!json_write_string(write, user, mdpp->title)) return false;
+    } else {
+        if (!JSON_LIT("null")) return false;
+    }
+
+    if (!JSON_LIT(", \"meta\": {")) return false;
+    for (Meta *meta = mdpp->meta_first; meta != NULL; meta = meta->next) {
+        if (meta != mdpp->meta_first && !JSON_LIT(", ")) return false;
+        if (!json_write_string(write, user, meta->name)) return false;
+        if (!JSON_LIT(": ")) return false;
+        if (!json_write_string(write, user, meta->val)) return false;
+    }
+    return JSON_LIT("}}\n");
+#undef JSON_LIT
+}
+
+MDPPDEF void *
+mdpp_alloc(Mdpp *mdpp, size_t size)
+{
+    void *result = arena_alloc(&mdpp->arena, size);
+    if (result == NULL) mdpp_fail(mdpp, "Unable to allocate %zu bytes", size);
+    return result;
+}
+
+MDPPDEF Mdpp_Stats
+mdpp_stats(const Mdpp *mdpp)
+{
+    return (Mdpp_Stats) {
+        .lines = mdpp->lines,
+        .allocations = exec_allocations(mdpp),
+        .warmup_allocations = mdpp->warmup_allocations,
+        .lex_allocations = lex_allocations(mdpp),
+    };
+}
+
+MDPPDEF bool
+mdpp_buffer_write(void *user, const char *data, size_t count)
+{
+    Mdpp_Buffer *buf = (Mdpp_Buffer*)user;
+    if (buf->count + count > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 256;
+        while (buf->count + count > capacity) capacity *= 2;
+        char *grown = (char*)realloc(buf->data, capacity);
+        if (grown == NULL) return false;
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->count, data, count);
+    buf->count += count;
+    return true;
+}
+
+MDPPDEF void
+mdpp_buffer_free(Mdpp_Buffer *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->count = 0;
+    buf->capacity = 0;
+}
+
+typedef struct {
+    pid_t pid;
+    FILE *write;
+    FILE *read;
+    // Kept across commands so reading responses only allocates when they
+    // outgrow it
+    char *line_buf;
+    size_t line_cap;
+} Sh_Shell;
+
+static bool
+sh_exec(void *user, Mdpp *mdpp, const char *command, size_t count,
+        const char **result, size_t *result_count)
+{
+    Sh_Shell *sh = (Sh_Shell*)user;
+    fprintf(sh->write, "%.*s;\n", (int)count, command);
+    if (fflush(sh->write) != 0) return false;
+
+    // TODO: Handle multi-line shell return?
+    ssize_t read = getline(&sh->line_buf, &sh->line_cap, sh->read);
+    if (read < 0 && ferror(sh->read)) return false;
+
+    String_View line = SV_NULL;
+    if (read > 0) line = sv_trim_right(sv_from_parts(sh->line_buf, read));
+
+    char *data = (char*)mdpp_alloc(mdpp, line.count);
+    if (data == NULL) return false;
+    memcpy(data, line.data, line.count);
+    *result = data;
+    *result_count = line.count;
+    return true;
+}
+
+static bool
+sh_set(void *user, Mdpp *mdpp, const char *name, size_t name_count,
+       const char *val, size_t val_count)
+{
+    Sh_Shell *sh = (Sh_Shell*)user;
+    fprintf(sh->write, "%.*s='%.*s';\n", (int)name_count, name,
+            (int)val_count, val);
+    (void)mdpp;
+    return fflush(sh->write) == 0;
+}
+
+MDPPDEF bool
+mdpp_shell_sh_start(Mdpp_Shell *shell)
+{
+    enum { PIPE_READ = 0, PIPE_WRITE };
+
+    Sh_Shell *sh = (Sh_Shell*)calloc(1, sizeof(*sh));
+    if (sh == NULL) return false;
+
+    // in is the shell's stdin, out its stdout
+    int in[2], out[2];
+    if (pipe(in) < 0) goto fail_in;
+    if (pipe(out) < 0) goto fail_out;
+    // Don't leak our ends into other children, or the shell won't see EOF
+    if (fcntl(in[PIPE_WRITE], F_SETFD, FD_CLOEXEC) < 0
+            || fcntl(out[PIPE_READ], F_SETFD, FD_CLOEXEC) < 0) {
+        goto fail_fork;
+    }
+
+    sh->pid = fork();
+    if (sh->pid < 0) goto fail_fork;
+    if (sh->pid == 0) {
+        if (dup2(in[PIPE_READ], STDIN_FILENO) < 0
+                || dup2(out[PIPE_WRITE], STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        close(in[PIPE_READ]);
+        close(out[PIPE_WRITE]);
+        execl("/bin/sh", "/bin/sh", (char*)NULL);
+        _exit(127);
+    }
+
+    close(in[PIPE_READ]);
+    close(out[PIPE_WRITE]);
+    sh->write = fdopen(in[PIPE_WRITE], "w");
+    sh->read = fdopen(out[PIPE_READ], "r");
+    if (sh->write == NULL || sh->read == NULL) {
+        if (sh->write) fclose(sh->write);
+        else close(in[PIPE_WRITE]);
+        if (sh->read) fclose(sh->read);
+        else close(out[PIPE_READ]);
+        waitpid(sh->pid, NULL, 0);
+        free(sh);
+        return false;
+    }
+
+    *shell = (Mdpp_Shell) {
+        .user = sh,
+        .exec = sh_exec,
+        .set = sh_set,
+    };
+    return true;
+
+fail_fork:
+    close(out[PIPE_READ]);
+    close(out[PIPE_WRITE]);
+fail_out:
+    close(in[PIPE_READ]);
+    close(in[PIPE_WRITE]);
+fail_in:
+    free(sh);
+    return false;
+}
+
+MDPPDEF bool
+mdpp_shell_sh_stop(Mdpp_Shell *shell)
+{
+    Sh_Shell *sh = (Sh_Shell*)shell->user;
+    if (sh == NULL) return true;
+
+    // Closing its stdin makes the shell exit
+    bool ok = fclose(sh->write) == 0;
+    ok = fclose(sh->read) == 0 && ok;
+    ok = waitpid(sh->pid, NULL, 0) == sh->pid && ok;
+
+    free(sh->line_buf);
+    free(sh);
+    *shell = (Mdpp_Shell) {0};
+    return ok;
+}
+
+#endif // MDPP_IMPLEMENTATION
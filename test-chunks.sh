@@ -0,0 +1,98 @@
+#!/usr/bin/env sh
+#
+# Check splitting documents into chunks doesn't change the output, by running
+# random documents through `./mdpp -j 1` and with tiny chunks
+
+set -e
+
+count="${1:-200}"
+
+if [ ! -x "./mdpp" ]; then
+    echo "ERROR: Executable './mdpp' not found!" > /dev/stderr
+    echo "ERROR: Please compile the project and ensure it is executable." > /dev/stderr
+    exit 1
+fi
+
+dest="$(mktemp -d)"
+trap 'rm -r "$dest"' EXIT
+
+# Lines are picked at random from pieces which straddle the interesting cases:
+# directives, escapes, code blocks, blank and whitespace-only lines
+generate() {
+    awk -v seed="$1" 'BEGIN {
+        srand(seed)
+        n = split("plain text|Hello $(echo mdpp)|an escaped \\$(echo directive)|" \
+            "    In a $(echo code block)|\tIn a tabbed $(echo code block)||   |" \
+            "trailing space   |%title A $(echo title)|%meta author Someone|%|" \
+            "1 + 2 = $(echo $(expr 1 + 2))|$$a + b$$|x=$(x=`expr 1 + 1`; echo $x)|" \
+            "y = $(echo $x)|two $(echo one) $(echo two)|a \\\\ backslash|" \
+            "ends with a backslash \\|$(echo unclosed", pieces, "|")
+        lines = int(rand() * 40)
+        for (i = 0; i < lines; i++) {
+            # Keep unclosed directives rare so most documents run to the end
+            p = int(rand() * n) + 1
+            if (p == n && rand() < 0.8) p = 1
+            print pieces[p]
+        }
+    }'
+}
+
+failed=0
+i=0
+while [ "$i" -lt "$count" ]; do
+    generate "$i" > "$dest/doc.md"
+    chunk_min="$(awk -v seed="$i" 'BEGIN { srand(seed); print int(rand() * 64) + 1 }')"
+
+    status=0
+    ./mdpp -j 1 "$dest/doc.md" > "$dest/expected" 2>&1 || status=$?
+    echo "exit $status" >> "$dest/expected"
+    status=0
+    ./mdpp -j 4 --chunk-min "$chunk_min" "$dest/doc.md" > "$dest/actual" 2>&1 || status=$?
+    echo "exit $status" >> "$dest/actual"
+
+    if ! diff -u "$dest/expected" "$dest/actual" > "$dest/diff"; then
+        echo "FAIL: document $i with --chunk-min $chunk_min:" > /dev/stderr
+        cat "$dest/doc.md" "$dest/diff" > /dev/stderr
+        failed="$(($failed + 1))"
+    fi
+    i="$(($i + 1))"
+done
+
+# Running out of memory in a later chunk should still write the earlier ones.
+# Build a copy which can't grow any chunk's tokens past their first allocation
+cat > "$dest/oom.c" << EOF
+#include <stdlib.h>
+static void *small_realloc(void *ptr, size_t size);
+#define MDPP_REALLOC small_realloc
+#include "$PWD/mdpp.c"
+static void *
+small_realloc(void *ptr, size_t size)
+{
+    return size > 64*sizeof(Token) ? NULL : realloc(ptr, size);
+}
+EOF
+${CC:-cc} -o "$dest/mdpp-oom" "$dest/oom.c" -pthread
+
+# The first half is plain text (one token), the second is hundreds of them
+awk 'BEGIN {
+    for (i = 0; i < 60; i++) print "plain text which is merged into one token"
+    for (i = 0; i < 200; i++) print "$(echo x)"
+}' > "$dest/oom.md"
+
+status=0
+"$dest/mdpp-oom" -j 2 --chunk-min 16 "$dest/oom.md" > "$dest/oom.out" 2> "$dest/oom.err" || status=$?
+if [ "$status" -eq 0 ] \
+        || ! grep -q 'Unable to allocate tokens' "$dest/oom.err" \
+        || [ "$(head -n 1 "$dest/oom.out")" != "plain text which is merged into one token" ]; then
+    echo "FAIL: running out of memory in a later chunk" > /dev/stderr
+    cat "$dest/oom.err" > /dev/stderr
+    failed="$(($failed + 1))"
+fi
+
+if [ "$failed" -gt 0 ]; then
+    echo "$failed/$(($count + 1)) chunking checks failed!"
+    exit 1
+else
+    echo "All $(($count + 1)) chunking checks passed!"
+    exit 0
+fi
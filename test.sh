@@ -28,8 +28,17 @@ run_test() {
     input="$(head -n $(expr $input_end - 1) "$file" | tail -n $(expr $input_end - $args_end - 1))" 
     output="$(tail -n $(expr $(wc -l < "$file") - $input_end) "$file")"
 
+    # Argument lines starting with `|` are a filter for output which varies
+    # between runs
+    filter="$(echo "$args" | sed -n 's/^|//p')"
+    args="$(echo "$args" | grep -v '^|' || true)"
+
     echo "$output" > "$dest/$casename.expected"
-    echo "$input" | ./mdpp $args > "$dest/$casename.actual"
+    # Errors are compared after the output, rather than interleaved with it
+    # depending on when stdout happens to be flushed
+    echo "$input" | ./mdpp $args 2> "$dest/$casename.stderr" \
+        | sh -c "${filter:-cat}" > "$dest/$casename.actual"
+    cat "$dest/$casename.stderr" >> "$dest/$casename.actual"
 
     if ! (diff -q \
             --label "$casename.expected" "$dest/$casename.expected" \